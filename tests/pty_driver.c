@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// End-to-end driver: runs the shell under a pseudo-terminal, replays
+// recorded transcripts through readline exactly as typed, and reports
+// throughput, per-command latency percentiles and RSS growth.
+//
+//   pty_driver [-n COMMANDS] [-m MAX_GROWTH_KB] [-t TIMEOUT_MS] SHELL TRANSCRIPT...
+//
+// A transcript is a list of input lines, each followed by the output it must
+// produce:
+//
+//   # comment
+//   $ ech\t hello       <- typed as is, except \t is Tab, \e Escape, \\ a backslash
+//   hello               <- expected output lines, as fnmatch patterns (so
+//                          "*" matches anything and "\[" a bracket)
+//
+// Blank lines and lines starting with '#' are ignored.
+//
+// Every "$ " line counts as one command and is timed from the moment it is
+// written until the shell prompts again. The transcripts are replayed in a
+// loop until COMMANDS (default 100000) have run. The first pass warms up
+// the shell; RSS growth is measured from the end of that pass.
+
+#define PROMPT_MARK "<pty-driver>"
+#define DEFAULT_COMMANDS 100000
+#define DEFAULT_TIMEOUT_MS 5000
+#define MAX_REPORTED_FAILURES 5
+
+struct step {
+  char *input;      // Keystrokes, Enter included
+  char *display;    // The line as written in the transcript
+  char **expected;  // Patterns for the output lines
+  int num_expected;
+  const char *file;
+  int line;
+};
+
+struct steps {
+  struct step *items;
+  int count;
+  int cap;
+};
+
+struct output {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+void *xrealloc(void *ptr, size_t size) {
+  void *new_ptr = realloc(ptr, size);
+  if (!new_ptr) {
+    perror("realloc failed");
+    exit(EXIT_FAILURE);
+  }
+  return new_ptr;
+}
+
+// Turn the escapes in a transcript input line into keystrokes, then Enter
+char *parse_keystrokes(const char *text) {
+  char *keys = xrealloc(NULL, strlen(text) + 2);
+  size_t n = 0;
+  for (const char *p = text; *p; p++) {
+    if (p[0] == '\\' && p[1] == 't') {
+      keys[n++] = '\t';
+      p++;
+    } else if (p[0] == '\\' && p[1] == 'e') {
+      keys[n++] = '\033';
+      p++;
+    } else if (p[0] == '\\' && p[1] == '\\') {
+      keys[n++] = '\\';
+      p++;
+    } else {
+      keys[n++] = *p;
+    }
+  }
+  keys[n++] = '\r';
+  keys[n] = '\0';
+  return keys;
+}
+
+void load_transcript(const char *path, struct steps *steps) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  int line_no = 0;
+  struct step *current = NULL;
+  while ((len = getline(&line, &cap, file)) != -1) {
+    line_no++;
+    if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+    if (line[0] == '#' || len == 0) {
+      continue;
+    }
+    if (strncmp(line, "$ ", 2) == 0) {
+      if (steps->count == steps->cap) {
+        steps->cap = steps->cap ? steps->cap * 2 : 64;
+        steps->items = xrealloc(steps->items, steps->cap * sizeof(struct step));
+      }
+      current = &steps->items[steps->count++];
+      *current = (struct step){parse_keystrokes(line + 2), strdup(line + 2), NULL, 0, path, line_no};
+    } else if (current == NULL) {
+      fprintf(stderr, "%s:%d: output before the first command\n", path, line_no);
+      exit(EXIT_FAILURE);
+    } else {
+      current->expected = xrealloc(current->expected, (current->num_expected + 1) * sizeof(char *));
+      current->expected[current->num_expected++] = strdup(line);
+    }
+  }
+  free(line);
+  fclose(file);
+}
+
+double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Resident set size of a process in kB, or -1
+long read_rss_kb(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+  char line[256];
+  long rss = -1;
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "VmRSS: %ld", &rss) == 1) break;
+  }
+  fclose(file);
+  return rss;
+}
+
+// Read from the terminal until the shell prompts, after the echoed input line
+// and the output that follows it when "after_input" is set. Returns 0 on
+// timeout or end of file.
+int read_until_prompt(int master, struct output *out, int after_input, int timeout_ms) {
+  out->len = 0;
+  double deadline = now_ms() + timeout_ms;
+  while (1) {
+    if (out->len > 0) {
+      // Readline may redraw the prompt while editing, so only a prompt after
+      // the end of the input line counts
+      out->data[out->len] = '\0';
+      char *start = after_input ? strchr(out->data, '\n') : out->data;
+      if (start && strstr(start, PROMPT_MARK)) {
+        return 1;
+      }
+    }
+
+    int left = (int)(deadline - now_ms());
+    if (left <= 0) {
+      return 0;
+    }
+    struct pollfd pfd = {master, POLLIN, 0};
+    if (poll(&pfd, 1, left) == -1) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    if (out->cap - out->len < 4097) {
+      out->cap = out->cap ? out->cap * 2 : 8192;
+      out->data = xrealloc(out->data, out->cap);
+    }
+    ssize_t n = read(master, out->data + out->len, 4096);
+    if (n <= 0) {
+      if (n == -1 && errno == EINTR) continue;
+      return 0;
+    }
+    out->len += n;
+  }
+}
+
+// Split the terminal output of one command into lines, dropping carriage
+// returns and escape sequences. The echoed input line and the next prompt
+// are not part of the command's output.
+int output_lines(char *data, char ***lines) {
+  char *src = data, *dst = data;
+  while (*src) {
+    if (*src == '\033') {
+      // CSI: ESC [ params final; anything else: ESC and one character
+      src++;
+      if (*src == '[') {
+        src++;
+        while (*src && !(*src >= '@' && *src <= '~')) src++;
+      }
+      if (*src) src++;
+    } else if (*src == '\r' || *src == '\a') {
+      src++;
+    } else {
+      *dst++ = *src++;
+    }
+  }
+  *dst = '\0';
+
+  char *prompt = strstr(strchr(data, '\n'), PROMPT_MARK);
+  *prompt = '\0';
+
+  int count = 0;
+  char *line = strchr(data, '\n') + 1;
+  *lines = NULL;
+  while (*line) {
+    char *end = strchr(line, '\n');
+    if (end) *end = '\0';
+    *lines = xrealloc(*lines, (count + 1) * sizeof(char *));
+    (*lines)[count++] = line;
+    if (!end) break;
+    line = end + 1;
+  }
+  return count;
+}
+
+// Check the output against the transcript; report the first few mismatches
+int check_output(const struct step *step, struct output *out, int *reported) {
+  char **lines;
+  int count = output_lines(out->data, &lines);
+  int ok = count == step->num_expected;
+  for (int i = 0; ok && i < count; i++) {
+    ok = fnmatch(step->expected[i], lines[i], 0) == 0;
+  }
+
+  if (!ok && (*reported)++ < MAX_REPORTED_FAILURES) {
+    fprintf(stderr, "%s:%d: $ %s\n  expected:\n", step->file, step->line, step->display);
+    for (int i = 0; i < step->num_expected; i++) fprintf(stderr, "    %s\n", step->expected[i]);
+    fprintf(stderr, "  got:\n");
+    for (int i = 0; i < count; i++) fprintf(stderr, "    %s\n", lines[i]);
+  }
+  free(lines);
+  return ok;
+}
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+double percentile(const double *sorted, long count, double p) {
+  long i = (long)(p / 100 * (count - 1) + 0.5);
+  return sorted[i];
+}
+
+void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-n COMMANDS] [-m MAX_GROWTH_KB] [-t TIMEOUT_MS] SHELL TRANSCRIPT...\n", name);
+  exit(2);
+}
+
+int main(int argc, char *argv[]) {
+  long commands = DEFAULT_COMMANDS;
+  long max_growth_kb = -1;
+  int timeout_ms = DEFAULT_TIMEOUT_MS;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:m:t:")) != -1) {
+    switch (opt) {
+      case 'n': commands = atol(optarg); break;
+      case 'm': max_growth_kb = atol(optarg); break;
+      case 't': timeout_ms = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (argc - optind < 2 || commands <= 0) {
+    usage(argv[0]);
+  }
+  // The shell runs in a scratch directory, so resolve its path first
+  char *shell = realpath(argv[optind], NULL);
+  if (shell == NULL) {
+    perror(argv[optind]);
+    return 2;
+  }
+
+  struct steps steps = {0};
+  for (int i = optind + 1; i < argc; i++) {
+    load_transcript(argv[i], &steps);
+  }
+  if (steps.count == 0) {
+    fprintf(stderr, "%s: no commands in the transcripts\n", argv[0]);
+    return 2;
+  }
+
+  // Transcripts may create files, so they get a directory of their own
+  char dir[] = "/tmp/pty-driver-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  struct winsize size = {.ws_row = 24, .ws_col = 200};
+  int master;
+  pid_t pid = forkpty(&master, NULL, NULL, &size);
+  if (pid == -1) {
+    perror("forkpty");
+    return 1;
+  }
+  if (pid == 0) {
+    // A fixed environment: plain terminal, no user readline config or history
+    // file, and only system commands to complete
+    if (chdir(dir) != 0) _exit(127);
+    setenv("PATH", "/usr/bin:/bin", 1);
+    setenv("TERM", "dumb", 1);
+    setenv("INPUTRC", "/dev/null", 1);
+    setenv("PS1", PROMPT_MARK "$ ", 1);
+    setenv("PS2", PROMPT_MARK "> ", 1);
+    setenv("HISTSIZE", "1000", 1);
+    setenv("SHELL", shell, 1); // For transcripts that run "$SHELL -c ..."
+    unsetenv("HISTFILE");
+    execl(shell, shell, (char *)NULL);
+    perror(shell);
+    _exit(127);
+  }
+
+  struct output out = {0};
+  if (!read_until_prompt(master, &out, 0, timeout_ms)) {
+    fprintf(stderr, "%s: no prompt from %s\n", argv[0], shell);
+    kill(pid, SIGKILL);
+    return 1;
+  }
+
+  double *latencies = xrealloc(NULL, commands * sizeof(double));
+  long failures = 0;
+  int reported = 0;
+  long rss_start = -1, rss_peak = -1;
+  double started = now_ms();
+  long done;
+  for (done = 0; done < commands; done++) {
+    const struct step *step = &steps.items[done % steps.count];
+    if (done == steps.count) {
+      rss_start = read_rss_kb(pid);
+    }
+
+    double sent = now_ms();
+    if (write(master, step->input, strlen(step->input)) == -1 ||
+        !read_until_prompt(master, &out, 1, timeout_ms)) {
+      fprintf(stderr, "%s:%d: $ %s\n  no prompt within %d ms\n", step->file, step->line, step->display,
+              timeout_ms);
+      failures++;
+      break;
+    }
+    latencies[done] = now_ms() - sent;
+    if (!check_output(step, &out, &reported)) {
+      failures++;
+    }
+    if (done % 1000 == 0) {
+      long rss = read_rss_kb(pid);
+      if (rss > rss_peak) rss_peak = rss;
+    }
+  }
+  double elapsed = now_ms() - started;
+  long rss_end = read_rss_kb(pid);
+  if (rss_end > rss_peak) rss_peak = rss_end;
+  if (rss_start == -1) rss_start = rss_end;
+
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  close(master);
+  char cleanup[64];
+  snprintf(cleanup, sizeof(cleanup), "rm -rf %s", dir);
+  if (system(cleanup) != 0) fprintf(stderr, "%s: could not remove %s\n", argv[0], dir);
+
+  if (done > 0) {
+    qsort(latencies, done, sizeof(double), compare_doubles);
+    printf("commands:    %ld (%d per pass, %ld failed)\n", done, steps.count, failures);
+    printf("throughput:  %.0f commands/sec\n", done / (elapsed / 1000));
+    printf("latency ms:  p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n", percentile(latencies, done, 50),
+           percentile(latencies, done, 90), percentile(latencies, done, 99), percentile(latencies, done, 99.9),
+           latencies[done - 1]);
+    printf("rss kB:      %ld after warm-up, %ld at end, %ld peak, growth %ld\n", rss_start, rss_end, rss_peak,
+           rss_end - rss_start);
+  }
+  free(latencies);
+  free(shell);
+
+  if (max_growth_kb >= 0 && rss_end - rss_start > max_growth_kb) {
+    fprintf(stderr, "%s: RSS grew by %ld kB (limit %ld kB)\n", argv[0], rss_end - rss_start, max_growth_kb);
+    return 1;
+  }
+  return failures > 0 ? 1 : 0;
+}